@@ -1 +1,2 @@
 g++ -v -o v543lxi -lwiringPi v543lxi.c
+g++ -std=c++11 -c v543client.cpp
@@ -0,0 +1,536 @@
+/*
+
+klient dla v543lxi, opis w v543client.h
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <memory>
+#include "v543client.h"
+
+namespace v543 {
+
+//------------------------------------------------------------------------------
+// tak samo jak pszModeDesc / volRangeInfo / resRangeInfo w serwerze
+const char *modeLabel( Mode mode ) {
+    switch ( mode ) {
+        case MODE_R:    return "R";
+        case MODE_AC:   return "AC";
+        case MODE_DC:   return "DC";
+        default:        return "error";
+    }
+}
+
+const char *rangeLabel( Mode mode, int rangeId ) {
+    static const char *volLabels[] = { "100V", "1V", "1kV", "10V", "100mV", "error", "error", "error" };
+    static const char *resLabels[] = { "100k", "1k", "error", "10k", "error", "1M", "error", "10M" };
+    if ( rangeId < 0 || rangeId > 7 ) {
+        return "error";
+    }
+    if ( mode == MODE_DC || mode == MODE_AC ) {
+        return volLabels[ rangeId ];
+    }
+    if ( mode == MODE_R ) {
+        return resLabels[ rangeId ];
+    }
+    return "error";
+}
+
+//------------------------------------------------------------------------------
+// "error" albo "1, wrong mode error" - "0,\"No error\"" to normalna odpowiedź
+static bool isErrorResponse( const std::string &line ) {
+    if ( line == "error" ) {
+        return true;
+    }
+    return line.size() > 6 && isdigit( (unsigned char)line[ 0 ] ) &&
+           line.find( ", " ) != std::string::npos &&
+           line.compare( line.size() - 6, 6, " error" ) == 0;
+}
+
+static std::vector<std::string> split( const std::string &s, char sep ) {
+    std::vector<std::string> out;
+    size_t start = 0, pos;
+    while ( ( pos = s.find( sep, start ) ) != std::string::npos ) {
+        out.push_back( s.substr( start, pos - start ) );
+        start = pos + 1;
+    }
+    out.push_back( s.substr( start ) );
+    return out;
+}
+
+static uint32_t getLe32( const unsigned char *p ) {
+    return p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 ) | ( (uint32_t)p[ 3 ] << 24 );
+}
+
+static float getLeFloat( const unsigned char *p ) {
+    uint32_t u = getLe32( p );
+    float v;
+    memcpy( &v, &u, sizeof( v ) );
+    return v;
+}
+
+//------------------------------------------------------------------------------
+// tryb,opis,zakres,etykieta,wartość zakresu,polaryzacja,odczyt,raw,seq,czas
+Reading parseMeasureAll( const std::string &csv ) {
+    std::vector<std::string> f = split( csv, ',' );
+    Reading r;
+    if ( f.size() != 10 ) {
+        throw ScpiError( "malformed :measure:all? response: " + csv );
+    }
+    r.mode = (Mode)atoi( f[ 0 ].c_str() );
+    r.rangeId = atoi( f[ 2 ].c_str() );
+    r.rangeLabel = f[ 3 ];
+    r.rangeValue = strtod( f[ 4 ].c_str(), NULL );
+    r.polarity = atoi( f[ 5 ].c_str() );
+    r.value = strtod( f[ 6 ].c_str(), NULL );
+    r.raw = strtoul( f[ 7 ].c_str(), NULL, 16 );
+    r.seq = strtoul( f[ 8 ].c_str(), NULL, 10 );
+    r.timestamp = strtoull( f[ 9 ].c_str(), NULL, 10 );
+    return r;
+}
+
+//------------------------------------------------------------------------------
+// 28 bajtów z :measure:all:binary?, układ opisany przy handleMeasureAllBinary
+Reading parseMeasureAllBinary( const std::string &block ) {
+    const unsigned char *p = (const unsigned char*)block.data();
+    Reading r;
+    if ( block.size() != 28 ) {
+        throw ScpiError( "malformed :measure:all:binary? block" );
+    }
+    r.seq = getLe32( p + 0 );
+    r.timestamp = getLe32( p + 4 ) | ( (uint64_t)getLe32( p + 8 ) << 32 );
+    r.raw = getLe32( p + 12 );
+    r.mode = (Mode)p[ 16 ];
+    r.rangeId = p[ 17 ];
+    r.polarity = p[ 18 ];
+    r.rangeValue = getLeFloat( p + 20 );
+    r.value = getLeFloat( p + 24 );
+    r.rangeLabel = rangeLabel( r.mode, r.rangeId );
+    return r;
+}
+
+//------------------------------------------------------------------------------
+// płaski JSON z /frame i /stream, klucze znamy więc bez pełnego parsera
+static std::string jsonField( const std::string &json, const char *key ) {
+    std::string pattern = std::string( "\"" ) + key + "\":";
+    size_t pos = json.find( pattern );
+    if ( pos == std::string::npos ) {
+        return "";
+    }
+    pos += pattern.size();
+    if ( json[ pos ] == '"' ) {
+        size_t end = json.find( '"', pos + 1 );
+        return json.substr( pos + 1, end - pos - 1 );
+    }
+    return json.substr( pos, json.find_first_of( ",}", pos ) - pos );
+}
+
+Reading parseFrameJson( const std::string &json ) {
+    Reading r;
+    r.seq = strtoul( jsonField( json, "seq" ).c_str(), NULL, 10 );
+    r.timestamp = strtoull( jsonField( json, "timestamp" ).c_str(), NULL, 10 );
+    r.mode = (Mode)atoi( jsonField( json, "modeId" ).c_str() );
+    r.rangeId = atoi( jsonField( json, "rangeId" ).c_str() );
+    r.rangeLabel = jsonField( json, "range" );
+    r.rangeValue = strtod( jsonField( json, "rangeValue" ).c_str(), NULL );
+    r.polarity = atoi( jsonField( json, "polarity" ).c_str() );
+    r.value = strtod( jsonField( json, "value" ).c_str(), NULL );
+    r.raw = strtoul( jsonField( json, "raw" ).c_str(), NULL, 16 );
+    return r;
+}
+
+//------------------------------------------------------------------------------
+// rekordy seq,czas,tryb,zakres,polaryzacja,odczyt rozdzielone ';'
+std::vector<Reading> parseHistory( const std::string &records ) {
+    std::vector<Reading> out;
+    if ( records.empty() ) {
+        return out;
+    }
+    std::vector<std::string> items = split( records, ';' );
+    for ( size_t i = 0; i < items.size(); i++ ) {
+        std::vector<std::string> f = split( items[ i ], ',' );
+        Reading r;
+        if ( f.size() != 6 ) {
+            throw ScpiError( "malformed history record: " + items[ i ] );
+        }
+        r.seq = strtoul( f[ 0 ].c_str(), NULL, 10 );
+        r.timestamp = strtoull( f[ 1 ].c_str(), NULL, 10 );
+        r.mode = (Mode)atoi( f[ 2 ].c_str() );
+        r.rangeId = atoi( f[ 3 ].c_str() );
+        r.polarity = atoi( f[ 4 ].c_str() );
+        r.value = strtod( f[ 5 ].c_str(), NULL );
+        r.rangeLabel = rangeLabel( r.mode, r.rangeId );
+        out.push_back( r );
+    }
+    return out;
+}
+
+//------------------------------------------------------------------------------
+static int connectTo( const std::string &host, int port ) {
+    struct addrinfo hints, *res, *ai;
+    char service[ 16 ];
+    int s = -1;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf( service, sizeof( service ), "%d", port );
+    if ( getaddrinfo( host.c_str(), service, &hints, &res ) != 0 ) {
+        return -1;
+    }
+    for ( ai = res; ai != NULL; ai = ai->ai_next ) {
+        if ( ( s = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol ) ) < 0 ) {
+            continue;
+        }
+        if ( connect( s, ai->ai_addr, ai->ai_addrlen ) == 0 ) {
+            break;
+        }
+        close( s );
+        s = -1;
+    }
+    freeaddrinfo( res );
+    return s;
+}
+
+// -------------- Connection ---------------------------------------------------
+
+Connection::Connection( const std::string &host, int port ) : closed_( false ) {
+    if ( ( socket_ = connectTo( host, port ) ) < 0 ) {
+        throw ConnectionError( "unable to connect to " + host );
+    }
+    reader_ = std::thread( &Connection::readerLoop, this );
+}
+
+Connection::~Connection() {
+    closed_ = true;
+    shutdown( socket_, SHUT_RDWR );
+    reader_.join();
+    close( socket_ );
+    failAll( "connection closed" );
+}
+
+size_t Connection::inFlight() {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return pending_.size();
+}
+
+//------------------------------------------------------------------------------
+// do kolejki i od razu w sieć, nie czekamy na poprzednie odpowiedzi
+template <class T>
+std::future<T> Connection::send( const std::string &command, bool block,
+                                 std::function<T( const std::string& )> parse ) {
+    std::shared_ptr< std::promise<T> > promise = std::make_shared< std::promise<T> >();
+    std::future<T> future = promise->get_future();
+    std::string line = command + "\n";
+    Pending p;
+
+    p.block = block;
+    p.complete = [ promise, parse ]( const std::string &response ) {
+        try {
+            promise->set_value( parse( response ) );
+        }
+        catch ( ... ) {
+            promise->set_exception( std::current_exception() );
+        }
+    };
+    p.fail = [ promise ]( std::exception_ptr e ) {
+        promise->set_exception( e );
+    };
+
+    // writeMutex_ trzyma kolejność kolejki i gniazda, mutex_ tylko na chwilę
+    // wstawienia - reader nie może czekać na zapis, bo serwer czeka na nas
+    std::lock_guard<std::mutex> writeLock( writeMutex_ );
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        if ( closed_ ) {
+            p.fail( std::make_exception_ptr( ConnectionError( "connection closed" ) ) );
+            return future;
+        }
+        pending_.push_back( p );
+    }
+    for ( size_t sent = 0; sent < line.size(); ) {
+        ssize_t n = ::send( socket_, line.data() + sent, line.size() - sent, MSG_NOSIGNAL );
+        if ( n <= 0 ) {
+            // zerwane - reader dostanie błąd i obsłuży całą kolejkę, z nami
+            shutdown( socket_, SHUT_RDWR );
+            break;
+        }
+        sent += n;
+    }
+    return future;
+}
+
+std::future<std::string> Connection::query( const std::string &command ) {
+    return send<std::string>( command, false, []( const std::string &s ) { return s; } );
+}
+
+std::future<std::string> Connection::queryBlock( const std::string &command ) {
+    return send<std::string>( command, true, []( const std::string &s ) { return s; } );
+}
+
+std::future<std::string> Connection::identify() {
+    return query( "*idn?" );
+}
+
+std::future<Mode> Connection::function() {
+    return send<Mode>( ":sense:function?", false, []( const std::string &s ) {
+        return (Mode)atoi( s.c_str() );
+    } );
+}
+
+std::future<double> Connection::measureVoltage( bool ac ) {
+    return send<double>( ac ? ":measure:voltage:ac?" : ":measure:voltage:dc?", false, []( const std::string &s ) {
+        return strtod( s.c_str(), NULL );
+    } );
+}
+
+std::future<double> Connection::measureResistance() {
+    return send<double>( ":measure:resistance?", false, []( const std::string &s ) {
+        return strtod( s.c_str(), NULL );
+    } );
+}
+
+std::future<Reading> Connection::measureAll() {
+    return send<Reading>( ":measure:all:binary?", true, parseMeasureAllBinary );
+}
+
+std::future<uint32_t> Connection::raw() {
+    return send<uint32_t>( ":system:raw?", false, []( const std::string &s ) {
+        return (uint32_t)strtoul( s.c_str(), NULL, 16 );
+    } );
+}
+
+std::future< std::vector<Reading> > Connection::history( uint64_t t0, uint64_t t1 ) {
+    char command[ 64 ];
+    snprintf( command, sizeof( command ), ":trac:hist? %llu,%llu", (unsigned long long)t0, (unsigned long long)t1 );
+    return send< std::vector<Reading> >( command, false, parseHistory );
+}
+
+//------------------------------------------------------------------------------
+// linia z bufora, bez '\n'
+bool Connection::takeLine( std::string &line ) {
+    size_t nl = buffer_.find( '\n' );
+    if ( nl == std::string::npos ) {
+        return false;
+    }
+    line = buffer_.substr( 0, nl );
+    buffer_.erase( 0, nl + 1 );
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// blok #<n><długość><dane>\n, a jak serwer odpisał tekstem to linia (text)
+bool Connection::takeBlock( std::string &data, bool &text ) {
+    if ( buffer_.empty() ) {
+        return false;
+    }
+    if ( buffer_[ 0 ] != '#' ) {
+        text = true;
+        return takeLine( data );
+    }
+    text = false;
+    if ( buffer_.size() < 2 ) {
+        return false;
+    }
+    size_t digits = buffer_[ 1 ] - '0';
+    if ( buffer_.size() < 2 + digits ) {
+        return false;
+    }
+    size_t length = strtoul( buffer_.substr( 2, digits ).c_str(), NULL, 10 );
+    size_t total = 2 + digits + length;
+    if ( buffer_.size() < total + 1 ) {
+        return false;
+    }
+    data = buffer_.substr( 2 + digits, length );
+    buffer_.erase( 0, buffer_[ total ] == '\n' ? total + 1 : total );
+    return true;
+}
+
+bool Connection::fill() {
+    char chunk[ 4096 ];
+    ssize_t n = recv( socket_, chunk, sizeof( chunk ), 0 );
+    if ( n <= 0 ) {
+        return false;
+    }
+    buffer_.append( chunk, n );
+    return true;
+}
+
+void Connection::failAll( const std::string &why ) {
+    std::deque<Pending> failed;
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        closed_ = true;
+        failed.swap( pending_ );
+    }
+    for ( size_t i = 0; i < failed.size(); i++ ) {
+        failed[ i ].fail( std::make_exception_ptr( ConnectionError( why ) ) );
+    }
+}
+
+//------------------------------------------------------------------------------
+// odpowiedzi przychodzą w kolejności wysłania, więc pierwsza w kolejce jest nasza
+void Connection::readerLoop() {
+    for ( ;; ) {
+        bool block = false;
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            if ( !pending_.empty() ) {
+                block = pending_.front().block;
+            }
+        }
+
+        std::string response;
+        bool text = true;
+        bool complete = block ? takeBlock( response, text ) : takeLine( response );
+        if ( !complete ) {
+            if ( closed_ || !fill() ) {
+                failAll( "connection lost" );
+                return;
+            }
+            continue;
+        }
+
+        Pending p;
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            if ( pending_.empty() ) {
+                continue;   // nikt nie pytał
+            }
+            p = pending_.front();
+            pending_.pop_front();
+        }
+        if ( text && isErrorResponse( response ) ) {
+            p.fail( std::make_exception_ptr( ScpiError( response ) ) );
+        }
+        else if ( block && text ) {
+            p.fail( std::make_exception_ptr( ScpiError( "expected binary block, got: " + response ) ) );
+        }
+        else {
+            p.complete( response );
+        }
+    }
+}
+
+// -------------- Pool ---------------------------------------------------------
+
+Pool::Pool( const std::string &host, int port, int size ) : host_( host ), port_( port ), cursor_( 0 ) {
+    connections_.resize( size );
+}
+
+//------------------------------------------------------------------------------
+// najmniej zajęte połączenie, zerwane nawiązujemy od nowa
+// stare zwalnia się dopiero, jak odda je ostatni używający
+std::shared_ptr<Connection> Pool::next() {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    size_t best = cursor_ % connections_.size();
+    size_t bestLoad = (size_t)-1;
+
+    for ( size_t k = 0; k < connections_.size(); k++ ) {
+        size_t i = ( cursor_ + k ) % connections_.size();
+        if ( connections_[ i ] && !connections_[ i ]->connected() ) {
+            connections_[ i ].reset();
+        }
+        size_t load = connections_[ i ] ? connections_[ i ]->inFlight() : 0;
+        if ( load < bestLoad ) {
+            best = i;
+            bestLoad = load;
+        }
+    }
+    cursor_ = best + 1;
+    if ( !connections_[ best ] ) {
+        connections_[ best ] = std::make_shared<Connection>( host_, port_ );
+    }
+    return connections_[ best ];
+}
+
+// -------------- FrameStream --------------------------------------------------
+
+FrameStream::FrameStream( const std::string &host, int httpPort, TCallback callback )
+    : host_( host ), port_( httpPort ), callback_( callback ), stop_( false ), socket_( -1 ) {
+    thread_ = std::thread( &FrameStream::loop, this );
+}
+
+FrameStream::~FrameStream() {
+    stop();
+}
+
+// gniazdo tylko shutdown, zamyka je wątek strumienia - pod socketMutex_,
+// więc nie trafimy w numer, który w międzyczasie dostał ktoś inny
+void FrameStream::stop() {
+    stop_ = true;
+    {
+        std::lock_guard<std::mutex> lock( socketMutex_ );
+        if ( socket_ >= 0 ) {
+            shutdown( socket_, SHUT_RDWR );
+        }
+    }
+    if ( thread_.joinable() ) {
+        thread_.join();
+    }
+}
+
+//------------------------------------------------------------------------------
+// GET /stream i linie "data: {...}", po zerwaniu próbujemy dalej co sekundę
+void FrameStream::loop() {
+    while ( !stop_ ) {
+        int s = connectTo( host_, port_ );
+        if ( s < 0 ) {
+            sleep( 1 );
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock( socketMutex_ );
+            if ( stop_ ) {
+                close( s );
+                break;
+            }
+            socket_ = s;
+        }
+
+        std::string request = "GET /stream HTTP/1.1\r\nHost: " + host_ + "\r\nAccept: text/event-stream\r\n\r\n";
+        std::string buffer;
+        bool headers = true;
+        char chunk[ 4096 ];
+        ssize_t n;
+
+        ::send( s, request.data(), request.size(), MSG_NOSIGNAL );
+        while ( !stop_ && ( n = recv( s, chunk, sizeof( chunk ), 0 ) ) > 0 ) {
+            buffer.append( chunk, n );
+            if ( headers ) {
+                size_t end = buffer.find( "\r\n\r\n" );
+                if ( end == std::string::npos ) {
+                    continue;
+                }
+                buffer.erase( 0, end + 4 );
+                headers = false;
+            }
+            size_t nl;
+            while ( ( nl = buffer.find( '\n' ) ) != std::string::npos ) {
+                std::string line = buffer.substr( 0, nl );
+                buffer.erase( 0, nl + 1 );
+                if ( line.compare( 0, 6, "data: " ) == 0 ) {
+                    callback_( parseFrameJson( line.substr( 6 ) ) );
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock( socketMutex_ );
+            socket_ = -1;
+            close( s );
+        }
+        if ( !stop_ ) {
+            sleep( 1 );
+        }
+    }
+}
+
+} // namespace v543
@@ -0,0 +1,207 @@
+/*
+
+klient dla v543lxi, do dołączenia do własnego programu:
+  g++ -std=c++11 -c v543client.cpp
+  g++ -std=c++11 -o program program.cpp v543client.o -lpthread
+
+wszystko asynchronicznie - zapytania lecą od razu jedno za drugim,
+odpowiedzi dopasowujemy po kolejności (serwer odpowiada po kolei)
+
+  v543::Pool pool( "10.0.0.5", 5555, 4 );
+  std::future<v543::Reading> r = pool.measureAll();
+  printf( "%f\n", r.get().value );
+
+*/
+
+#ifndef V543CLIENT_H
+#define V543CLIENT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <stdexcept>
+
+namespace v543 {
+
+#define V543_SCPI_PORT  5555
+
+// tryby jak pszModeDesc w serwerze
+enum Mode {
+    MODE_ERROR  = 0,
+    MODE_R      = 1,
+    MODE_AC     = 2,
+    MODE_DC     = 4
+};
+
+// zakresy napięcia jak volRangeInfo
+enum VoltageRange {
+    RANGE_100V  = 0,
+    RANGE_1V    = 1,
+    RANGE_1KV   = 2,
+    RANGE_10V   = 3,
+    RANGE_100MV = 4
+};
+
+// zakresy rezystancji jak resRangeInfo
+enum ResistanceRange {
+    RANGE_100K  = 0,
+    RANGE_1K    = 1,
+    RANGE_10K   = 3,
+    RANGE_1M    = 5,
+    RANGE_10M   = 7
+};
+
+// jedna ramka z miernika, tak jak ją widzi :measure:all?
+struct Reading {
+    Mode        mode;
+    int         rangeId;        // VoltageRange albo ResistanceRange, zależnie od trybu
+    std::string rangeLabel;
+    double      rangeValue;
+    int         polarity;
+    double      value;          // przeskalowany, dla DC ze znakiem
+    uint32_t    raw;
+    uint32_t    seq;
+    uint64_t    timestamp;      // ms od epoki
+
+    Reading() : mode( MODE_ERROR ), rangeId( 0 ), rangeValue( 0 ), polarity( 0 ),
+                value( 0 ), raw( 0 ), seq( 0 ), timestamp( 0 ) {}
+};
+
+// serwer odpowiedział błędem, np. "1, wrong mode error"
+class ScpiError : public std::runtime_error {
+public:
+    explicit ScpiError( const std::string &what ) : std::runtime_error( what ) {}
+};
+
+// połączenie zerwane albo nie udało się go nawiązać
+class ConnectionError : public std::runtime_error {
+public:
+    explicit ConnectionError( const std::string &what ) : std::runtime_error( what ) {}
+};
+
+// opis trybu i zakresu po stronie klienta, bez pytania serwera
+const char *modeLabel( Mode mode );
+const char *rangeLabel( Mode mode, int rangeId );
+
+//------------------------------------------------------------------------------
+// jedno połączenie, dowolnie wiele zapytań w locie
+class Connection {
+public:
+    Connection( const std::string &host, int port = V543_SCPI_PORT );
+    ~Connection();
+
+    // surowo: odpowiedź tekstowa bez '\n', albo zawartość bloku #NNN...
+    std::future<std::string> query( const std::string &command );
+    std::future<std::string> queryBlock( const std::string &command );
+
+    // typowane
+    std::future<std::string>            identify();
+    std::future<Mode>                   function();
+    std::future<double>                 measureVoltage( bool ac = false );
+    std::future<double>                 measureResistance();
+    std::future<Reading>                measureAll();
+    std::future<uint32_t>               raw();
+    std::future<std::vector<Reading> >  history( uint64_t t0, uint64_t t1 );
+
+    bool connected() const { return socket_ >= 0 && !closed_; }
+    size_t inFlight();
+
+private:
+    typedef std::function<void( const std::string& )>  TComplete;
+    typedef std::function<void( std::exception_ptr )>  TFail;
+
+    struct Pending {
+        bool        block;      // oczekujemy bloku binarnego
+        TComplete   complete;
+        TFail       fail;
+    };
+
+    template <class T>
+    std::future<T> send( const std::string &command, bool block,
+                         std::function<T( const std::string& )> parse );
+    void readerLoop();
+    bool takeLine( std::string &line );
+    bool takeBlock( std::string &data, bool &text );
+    bool fill();
+    void failAll( const std::string &why );
+
+    int                     socket_;
+    std::atomic<bool>       closed_;
+    std::mutex              writeMutex_;    // wstawienie do kolejki i zapis razem, żeby kolejność się zgadzała
+    std::mutex              mutex_;         // tylko kolejka, reader nigdy nie czeka na zapis
+    std::deque<Pending>     pending_;
+    std::string             buffer_;
+    std::thread             reader_;
+
+    Connection( const Connection& );
+    Connection &operator=( const Connection& );
+};
+
+//------------------------------------------------------------------------------
+// kilka połączeń, zapytania rozkładane po kolei na najmniej zajęte
+// next() oddaje shared_ptr, więc wymiana zerwanego połączenia w innym
+// wątku nie zabierze go spod ręki temu, kto właśnie z niego korzysta
+class Pool {
+public:
+    Pool( const std::string &host, int port = V543_SCPI_PORT, int size = 2 );
+
+    std::shared_ptr<Connection> next();
+
+    std::future<std::string>    query( const std::string &command )  { return next()->query( command ); }
+    std::future<Reading>        measureAll()                        { return next()->measureAll(); }
+    std::future<double>         measureVoltage( bool ac = false )   { return next()->measureVoltage( ac ); }
+    std::future<double>         measureResistance()                 { return next()->measureResistance(); }
+
+private:
+    std::string                                 host_;
+    int                                         port_;
+    std::vector< std::shared_ptr<Connection> >  connections_;
+    std::mutex                  mutex_;
+    size_t                      cursor_;
+
+    Pool( const Pool& );
+    Pool &operator=( const Pool& );
+};
+
+//------------------------------------------------------------------------------
+// strumień ramek z http (-w w serwerze), callback z wątku strumienia
+class FrameStream {
+public:
+    typedef std::function<void( const Reading& )> TCallback;
+
+    FrameStream( const std::string &host, int httpPort, TCallback callback );
+    ~FrameStream();
+
+    void stop();
+
+private:
+    void loop();
+
+    std::string         host_;
+    int                 port_;
+    TCallback           callback_;
+    std::atomic<bool>   stop_;
+    std::mutex          socketMutex_;   // socket_, jego zamknięcie i shutdown w stop()
+    int                 socket_;
+    std::thread         thread_;
+
+    FrameStream( const FrameStream& );
+    FrameStream &operator=( const FrameStream& );
+};
+
+// parsery odpowiedzi, przydają się też bez połączenia
+Reading parseMeasureAll( const std::string &csv );
+Reading parseMeasureAllBinary( const std::string &block );
+Reading parseFrameJson( const std::string &json );
+std::vector<Reading> parseHistory( const std::string &records );
+
+} // namespace v543
+
+#endif
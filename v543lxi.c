@@ -4,13 +4,15 @@ kompilacja:
   g++ -o v543lxi -lwiringPi v543.c
   
 uruchomienie:
-  ./v543lxi
+  ./v543lxi [-a katalog_archiwum] [-w port_http] [-r poleceń/s [-b zapas] [-d]] [-c ponowne_odczyty]
   
 */
 
 #include <stdio.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -19,6 +21,9 @@ uruchomienie:
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <wiringPi.h>
 
 #define SCPI_PORT	5555
@@ -31,18 +36,105 @@ uruchomienie:
 #define LED_READY   4
 #define LED_SCPI    5
 
+#define FRAME_LOCK  0       // klucz piLock dla ramki z przerwania
+#define ARCHIVE_LOCK 1      // klucz piLock dla archiwum
+
+#define FRAME_RING_SIZE         256     // ostatnie ramki dla archiwum
+
+#define SCPI_MAX_CLIENTS    16
+#define SCPI_BUDGET         4       // poleceń na klienta w jednym obiegu
+#define SCPI_RATE_BURST     10      // domyślny zapas żetonów
+#define SCPI_OUTPUT_SIZE    8192    // kolejka wyjściowa sesji
+#define SCPI_HISTORY_BUDGET 256     // rekordów historii na klienta w jednym obiegu
+
+#define FRAME_RECLOCK       2       // ile razy ponowić odczyt podejrzanej ramki
+#define FRAME_JUMP_LIMIT    5000    // większy skok cyferek w tym samym zakresie jest podejrzany
+
+// werdykt walidacji ramki
+#define FRAME_OK            0
+#define FRAME_BAD_BCD       1       // cyferka spoza 0..9
+#define FRAME_BAD_RANGE     2       // tryb albo zakres z pozycją "error"
+#define FRAME_IMPLAUSIBLE   3       // nie pasuje do poprzedniej ramki
+
 
 #define DEVICE_VENDOR       "Meratronik"
 #define DEVICE_NAME         "V543"
 #define DEVICE_SERIAL       "01473"
 #define FIRMWARE_VERSION    "NB02-666-tasza-2018"
 
+// jedna ramka z miernika - wszystko co trzeba, z jednego odczytu
+typedef struct {
+    unsigned long       raw;        // surowe 26 bitów
+    unsigned char       rangeId;    // zakres
+    unsigned char       modeId;     // tryb pracy
+    unsigned char       polarity;   // polaryzacja dla DC
+    unsigned long       seq;        // numer kolejny ramki
+    unsigned long long  timestamp;  // ms od epoki, chwila odczytu
+} TMeterFrame;
+
 unsigned char   uchLedReady = 0;
 unsigned char   uchLedScpi = 0;
-unsigned long   ulRawMeterData = 0L;
-unsigned char   uchRangeId = 0;
-unsigned char   uchModeId = 0;
-unsigned char   uchPolarity = 0;
+TMeterFrame     meterFrame = { 0 };
+TMeterFrame     frameRing[ FRAME_RING_SIZE ];
+int             iResponseLength = -1;   // >= 0 dla odpowiedzi binarnych
+const char     *pszScpiArgs = "";       // parametry bieżącego polecenia
+// stan kodera/dekodera, ten sam po obu stronach
+typedef struct {
+    unsigned long long  timestamp;
+    long long           delta;
+    int                 display;
+    unsigned int        state;
+    unsigned long       seq;
+} TArchiveState;
+
+// :trac:hist? w toku, czytany kawałkami w kolejnych obiegach
+typedef struct {
+    int                 active;
+    FILE               *file;           // bieżący segment, NULL = otworzyć następny
+    unsigned long long  base;           // czas bazowy bieżącego segmentu, 0 = jeszcze żaden
+    unsigned long long  t0, t1;
+    TArchiveState       state;
+    int                 sent;           // rekordów już wysłanych, dla ';'
+} THistoryCursor;
+
+// sesja klienta SCPI, z własnym kubełkiem żetonów
+typedef struct {
+    int                 socket;         // -1 wolne
+    struct sockaddr_in  address;
+    int                 length;
+    char                input[ 256 ];   // przyszło, jeszcze nie wykonane
+    int                 closing;        // klient skończył nadawać, dokończyć i zamknąć
+    float               tokens;
+    unsigned int        refill;         // millis ostatniego doładowania
+    unsigned int        since;          // millis początku sesji
+    unsigned long       commands;       // wykonane
+    unsigned long       limited;        // przytrzymane/odrzucone przez limit
+    int                 held;           // pierwsze polecenie już policzone jako przytrzymane
+    THistoryCursor      history;
+    int                 outLength;
+    char                output[ SCPI_OUTPUT_SIZE ];     // czeka aż klient odbierze
+} TScpiClient;
+
+TScpiClient     scpiClients[ SCPI_MAX_CLIENTS ];
+TScpiClient    *scpiCurrent = NULL;             // klient bieżącego polecenia
+float           fScpiRate = 0;                  // poleceń/s na klienta, 0 bez limitu
+float           fScpiBurst = SCPI_RATE_BURST;
+int             iScpiRateDelay = 0;             // 1 przytrzymuje zamiast błędu
+
+// liczniki walidacji ramek, pod FRAME_LOCK
+typedef struct {
+    unsigned long       published;      // poszły do klientów
+    unsigned long       badBcd;         // odrzucone, złe cyferki
+    unsigned long       badRange;       // odrzucone, zły tryb/zakres
+    unsigned long       implausible;    // odrzucone, niepotwierdzony skok
+    unsigned long       reclocked;      // ponowne odczyty
+    unsigned long       recovered;      // podejrzane, uratowane ponownym odczytem
+    unsigned long       windowClosed;   // READY zgasło zanim skończyły się ponowne odczyty
+} TFrameStats;
+
+TFrameStats     frameStats = { 0 };
+int             iFrameReclock = FRAME_RECLOCK;
+TMeterFrame     frameCandidate = { 0 };     // niepotwierdzony skok z poprzedniego okna READY, seq 0 = brak
 
 char* trim(char*);  
 void makeLower (char*);
@@ -56,6 +148,12 @@ void handleMeasureResistance(char*);
 void handleSenseFunction(char*);
 void handleSenseVoltageRange(char*);
 void handleSenseResistanceRange(char*);
+void handleMeasureAll(char*);
+void handleMeasureAllBinary(char*);
+void handleTraceHistory(char*);
+void handleSystemClients(char*);
+void handleSystemFrames(char*);
+int processScpiCommand(char*, char*);
 
 // prototyp handlerka komendy scpi, po prostu wypełnia wynik w out i tyle
 typedef void (*TScpiCommandHandler)(char*);
@@ -84,6 +182,8 @@ TCommand scpiCommands[] = {
     {   ":measure:voltage:dc?",     &handleMeasureVoltage },
     {   ":measure:voltage:ac?",     &handleMeasureVoltage },
     {   ":measure:resistance?",     &handleMeasureResistance },            
+    {   ":measure:all?",            &handleMeasureAll },
+    {   ":measure:all:binary?",     &handleMeasureAllBinary },
     // zakresy
     {   ":sense:voltage:dc:range?", &handleSenseVoltageRange },
     {   ":sense:voltage:ac:range?", &handleSenseVoltageRange },
@@ -93,6 +193,11 @@ TCommand scpiCommands[] = {
     // polecenia systemowe
     {   ":system:raw?",             &handleRaw },
     {   ":system:display?",         &handleDisplay }, 
+    {   ":system:clients?",         &handleSystemClients },
+    {   ":system:frames?",          &handleSystemFrames },
+    // archiwum
+    {   ":trac:hist?",              &handleTraceHistory },
+    {   ":trace:history?",          &handleTraceHistory },
     // bledy
     {   ":syst:err?",               &handleSystemError },
     {   "syst:err?",                &handleSystemError },     
@@ -132,14 +237,695 @@ const char *pszModeDesc[] = {
       "DC"        // 4        
 };
 
+//------------------------------------------------------------------------------
+// kopia ostatniej ramki, spójna - przerwanie nie podmieni w połowie
+void getMeterFrame( TMeterFrame *f ) {
+    piLock( FRAME_LOCK );
+    *f = meterFrame;
+    piUnlock( FRAME_LOCK );
+}
+
 //------------------------------------------------------------------------------
 // numeryczna zawartośc wystwietlacza    
-int getNumericDisplay( void ) {
+int getNumericDisplay( unsigned long raw ) {
     char s[16];
-    sprintf( s, "%05X", ulRawMeterData &0x1FFFF );        
+    sprintf( s, "%05lX", raw &0x1FFFF );        
     return atoi( s );
 }
 
+//------------------------------------------------------------------------------
+// zakres właściwy dla trybu z ramki, NULL jak tryb nieznany
+const TRangeInfo *getFrameRange( const TMeterFrame *f ) {
+    if ( f->modeId == 4 /*DC*/ || f->modeId == 2 /*AC*/ ) {
+        return &volRangeInfo[ f->rangeId ];
+    }
+    if ( f->modeId == 1 /*R*/ ) {
+        return &resRangeInfo[ f->rangeId ];
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// przeskalowany odczyt, dla DC już ze znakiem
+float getFrameValue( const TMeterFrame *f ) {
+    const TRangeInfo *ri = getFrameRange( f );
+    if ( ri == NULL ) {
+        return 0;
+    }
+    float v = ((float)getNumericDisplay( f->raw )) / ri->scale;
+    if ( f->modeId == 4 /*DC*/ && f->polarity != 1 ) {
+        v = -v;
+    }
+    return v;
+}
+
+//------------------------------------------------------------------------------
+// little endian, niezależnie od platformy
+void putLe32( unsigned char *p, unsigned long v ) {
+    for ( int i = 0; i < 4; i++ ) {
+        p[ i ] = ( v >> ( 8 * i ) ) & 0xFF;
+    }
+}
+
+void putLe64( unsigned char *p, unsigned long long v ) {
+    for ( int i = 0; i < 8; i++ ) {
+        p[ i ] = ( v >> ( 8 * i ) ) & 0xFF;
+    }
+}
+
+void putLeFloat( unsigned char *p, float v ) {
+    unsigned int u;
+    memcpy( &u, &v, sizeof( u ) );
+    putLe32( p, u );
+}
+
+unsigned long getLe32( const unsigned char *p ) {
+    unsigned long v = 0;
+    for ( int i = 3; i >= 0; i-- ) {
+        v = ( v << 8 ) | p[ i ];
+    }
+    return v;
+}
+
+unsigned long long getLe64( const unsigned char *p ) {
+    unsigned long long v = 0;
+    for ( int i = 7; i >= 0; i-- ) {
+        v = ( v << 8 ) | p[ i ];
+    }
+    return v;
+}
+
+//------------------------------------------------------------------------------
+// ostatnie ramki z przerwania, archiwum czyta je stąd w swoim tempie
+int getMeterFrameAt( unsigned long seq, TMeterFrame *f ) {
+    int found;
+    piLock( FRAME_LOCK );
+    *f = frameRing[ seq % FRAME_RING_SIZE ];
+    piUnlock( FRAME_LOCK );
+    found = ( f->seq == seq && seq != 0 );
+    return found;
+}
+
+//------------------------------------------------------------------------------
+// cyferki wyświetlacza z powrotem w surowy zapis, odwrotność getNumericDisplay
+unsigned long makeDisplayRaw( int value ) {
+    char s[16];
+    sprintf( s, "%05d", value );
+    return strtoul( s, NULL, 16 ) & 0x1FFFF;
+}
+
+// -------------- archiwum -----------------------------------------------------
+//
+// segment to plik v543-<czas ms pierwszej ramki>.seg, tylko dopisywany:
+//   nagłówek: "V543SEG1" + czas bazowy (u64 LE)
+//   rekord:   varint zigzag( delta delty czasu )
+//             varint zigzag( delta cyferek ) << 2 | stan << 1 | przeskok
+//             [varint stan]        bity 17..25 raw, tylko jak się zmieniły
+//             [varint przeskok]    seq - poprzedni seq - 1, jak różny od zera
+// wyświetlacz zmienia się powoli, więc typowy rekord to 2 bajty
+//
+// obok v543-<czas>.idx, wpis co ARCHIVE_INDEX_RECORDS rekordów:
+//   u32 pozycja w segmencie, u64 czas, u64 delta, u32 cyferki, u32 stan, u32 seq
+// czyli stan dekodera przed rekordem z tej pozycji - czytanie od t0
+// zaczyna od ostatniego wpisu przed t0 zamiast od początku segmentu
+
+#define ARCHIVE_MAGIC           "V543SEG1"
+#define ARCHIVE_HEADER_SIZE     16
+#define ARCHIVE_SEGMENT_RECORDS 100000  // potem nowy plik
+#define ARCHIVE_STEP_MS         600000  // większy skok zegara do przodu też zaczyna nowy plik
+#define ARCHIVE_FLUSH_MS        5000    // oszczędzamy kartę SD
+#define ARCHIVE_POLL_MS         50
+#define ARCHIVE_INDEX_RECORDS   1000    // co tyle rekordów wpis w indeksie
+#define ARCHIVE_INDEX_SIZE      32
+
+char           *pszArchiveDir = NULL;
+FILE           *archiveFile = NULL;
+FILE           *archiveIndex = NULL;
+unsigned long   ulArchiveRecords = 0;
+unsigned int    uiArchiveFlushed = 0;
+TArchiveState   archiveState;
+
+void archiveStateInit( TArchiveState *st, unsigned long long base ) {
+    st->timestamp = base;
+    st->delta = 0;
+    st->display = 0;
+    st->state = 0xFFFFFFFF;     // pierwszy rekord zawsze ze stanem
+    st->seq = 0;
+}
+
+unsigned long long zigzag( long long v ) {
+    return ( (unsigned long long)v << 1 ) ^ (unsigned long long)( v >> 63 );
+}
+
+long long unzigzag( unsigned long long v ) {
+    return (long long)( v >> 1 ) ^ -(long long)( v & 1 );
+}
+
+void putVarint( FILE *fp, unsigned long long v ) {
+    while ( v >= 0x80 ) {
+        fputc( ( v & 0x7F ) | 0x80, fp );
+        v >>= 7;
+    }
+    fputc( v, fp );
+}
+
+// 0 jak plik się skończył w pół liczby
+int getVarint( FILE *fp, unsigned long long *v ) {
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if ( ( c = fgetc( fp ) ) == EOF || shift > 63 ) {
+            return 0;
+        }
+        *v |= (unsigned long long)( c & 0x7F ) << shift;
+        shift += 7;
+    } while ( c & 0x80 );
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// nowy segment zaczynający się od czasu base
+int archiveOpenSegment( unsigned long long base ) {
+    char path[ 256 ];
+    unsigned char header[ ARCHIVE_HEADER_SIZE ];
+    if ( archiveFile != NULL ) {
+        fclose( archiveFile );
+    }
+    if ( archiveIndex != NULL ) {
+        fclose( archiveIndex );
+    }
+    archiveIndex = NULL;
+    snprintf( path, sizeof( path ), "%s/v543-%llu.seg", pszArchiveDir, base );
+    // zegar cofnięty dokładnie na istniejący segment - dopisanie by go zepsuło
+    while ( access( path, F_OK ) == 0 ) {
+        snprintf( path, sizeof( path ), "%s/v543-%llu.seg", pszArchiveDir, ++base );
+    }
+    if ( ( archiveFile = fopen( path, "ab" ) ) == NULL ) {
+        printf ( "40 error when opening archive segment %s: %s\n", path, strerror (errno) );
+        return 0;
+    }
+    memcpy( header, ARCHIVE_MAGIC, 8 );
+    putLe64( header + 8, base );
+    fwrite( header, 1, sizeof( header ), archiveFile );
+    archiveStateInit( &archiveState, base );
+    ulArchiveRecords = 0;
+    printf ( "41 archive segment %s\n", path );
+    // bez indeksu też się da, tylko czytanie od t0 wolniejsze
+    snprintf( path, sizeof( path ), "%s/v543-%llu.idx", pszArchiveDir, base );
+    if ( ( archiveIndex = fopen( path, "wb" ) ) == NULL ) {
+        printf ( "40 error when opening archive index %s: %s\n", path, strerror (errno) );
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// dopisanie jednej ramki do bieżącego segmentu
+// zegar cofnięty (NTP bez RTC) albo skok do przodu zaczyna nowy segment,
+// w jednym segmencie czas zawsze rośnie
+void archiveAppend( const TMeterFrame *f ) {
+    if ( archiveFile == NULL || ulArchiveRecords >= ARCHIVE_SEGMENT_RECORDS ||
+         f->timestamp < archiveState.timestamp || f->timestamp - archiveState.timestamp > ARCHIVE_STEP_MS ) {
+        if ( !archiveOpenSegment( f->timestamp ) ) {
+            return;
+        }
+    }
+    TArchiveState *st = &archiveState;
+    long long delta = (long long)( f->timestamp - st->timestamp );
+    int display = getNumericDisplay( f->raw );
+    unsigned int state = ( f->raw >> 17 ) & 0x1FF;
+    unsigned long gap = f->seq - st->seq - 1;
+    int stateFlag = ( state != st->state );
+    int gapFlag = ( gap != 0 );
+
+    if ( archiveIndex != NULL && ulArchiveRecords > 0 && ulArchiveRecords % ARCHIVE_INDEX_RECORDS == 0 ) {
+        unsigned char entry[ ARCHIVE_INDEX_SIZE ];
+        putLe32( entry + 0, ftell( archiveFile ) );
+        putLe64( entry + 4, st->timestamp );
+        putLe64( entry + 12, st->delta );
+        putLe32( entry + 20, st->display );
+        putLe32( entry + 24, st->state );
+        putLe32( entry + 28, st->seq );
+        fwrite( entry, 1, sizeof( entry ), archiveIndex );
+    }
+
+    putVarint( archiveFile, zigzag( delta - st->delta ) );
+    putVarint( archiveFile, ( zigzag( display - st->display ) << 2 ) | ( stateFlag << 1 ) | gapFlag );
+    if ( stateFlag ) {
+        putVarint( archiveFile, state );
+    }
+    if ( gapFlag ) {
+        putVarint( archiveFile, gap );
+    }
+    st->timestamp = f->timestamp;
+    st->delta = delta;
+    st->display = display;
+    st->state = state;
+    st->seq = f->seq;
+    ulArchiveRecords++;
+}
+
+//------------------------------------------------------------------------------
+// kolejny rekord z segmentu, 0 na końcu pliku
+int archiveDecode( FILE *fp, TArchiveState *st, TMeterFrame *f ) {
+    unsigned long long dod, word, v;
+    if ( !getVarint( fp, &dod ) || !getVarint( fp, &word ) ) {
+        return 0;
+    }
+    if ( word & 2 ) {
+        if ( !getVarint( fp, &v ) ) {
+            return 0;
+        }
+        st->state = v;
+    }
+    v = 0;
+    if ( ( word & 1 ) && !getVarint( fp, &v ) ) {
+        return 0;
+    }
+    st->delta += unzigzag( dod );
+    st->timestamp += st->delta;
+    st->display += unzigzag( word >> 2 );
+    st->seq += v + 1;
+
+    f->raw = ( (unsigned long)st->state << 17 ) | makeDisplayRaw( st->display );
+    f->rangeId = (f->raw >> 17) & 0x07;
+    f->modeId = (f->raw >> 22) & 0x07;
+    f->polarity = (f->raw >> 20) & 0x03;
+    f->seq = st->seq;
+    f->timestamp = st->timestamp;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// wątek archiwum, zbiera ramki z bufora przerwania i dopisuje na kartę
+PI_THREAD( archiveThread ) {
+    TMeterFrame f;
+    unsigned long seq = 0;
+    for ( ;; ) {
+        delay( ARCHIVE_POLL_MS );
+        getMeterFrame( &f );
+        if ( seq == 0 || f.seq - seq > FRAME_RING_SIZE ) {
+            // start albo nie nadążyliśmy, bierzemy co zostało w buforze
+            seq = f.seq > FRAME_RING_SIZE ? f.seq - FRAME_RING_SIZE : 0;
+        }
+        piLock( ARCHIVE_LOCK );
+        while ( seq < f.seq ) {
+            TMeterFrame g;
+            if ( getMeterFrameAt( ++seq, &g ) ) {
+                archiveAppend( &g );
+            }
+        }
+        if ( archiveFile != NULL && millis() - uiArchiveFlushed >= ARCHIVE_FLUSH_MS ) {
+            // najpierw segment, żeby indeks nie wskazywał za koniec
+            fflush( archiveFile );
+            if ( archiveIndex != NULL ) {
+                fflush( archiveIndex );
+            }
+            uiArchiveFlushed = millis();
+        }
+        piUnlock( ARCHIVE_LOCK );
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// następny segment do przeczytania dla [t0,t1], po segmencie after
+// (after 0 = pierwszy: zaczęty najpóźniej w t0, albo najwcześniejszy w ogóle)
+// katalog za każdym razem cały, więc liczba segmentów nie ma limitu
+// zwraca 1 jak jest, 0 jak koniec, -1 jak katalogu nie da się czytać
+int archiveFindSegment( unsigned long long after, unsigned long long t0, unsigned long long t1, unsigned long long *found ) {
+    DIR *dir;
+    struct dirent *de;
+    unsigned long long base;
+    int haveBefore = 0, haveNext = 0;
+    unsigned long long before = 0, next = 0;
+    if ( ( dir = opendir( pszArchiveDir ) ) == NULL ) {
+        return -1;
+    }
+    while ( ( de = readdir( dir ) ) != NULL ) {
+        if ( sscanf( de->d_name, "v543-%llu.seg", &base ) != 1 ) {
+            continue;
+        }
+        if ( after == 0 && base <= t0 && ( !haveBefore || base > before ) ) {
+            before = base;
+            haveBefore = 1;
+        }
+        if ( base > after && ( !haveNext || base < next ) ) {
+            next = base;
+            haveNext = 1;
+        }
+    }
+    closedir( dir );
+    if ( haveBefore ) {
+        next = before;
+        haveNext = 1;
+    }
+    if ( !haveNext || next > t1 ) {
+        return 0;
+    }
+    *found = next;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+void archiveCursorClose( THistoryCursor *h ) {
+    if ( h->file != NULL ) {
+        fclose( h->file );
+        h->file = NULL;
+    }
+    h->active = 0;
+}
+
+//------------------------------------------------------------------------------
+// przeskok kursora do ostatniego wpisu indeksu przed t0
+// brak indeksu albo wpisu to nic, dekodujemy od nagłówka
+void archiveCursorSeek( THistoryCursor *h ) {
+    char path[ 256 ];
+    unsigned char entry[ ARCHIVE_INDEX_SIZE ];
+    unsigned long offset = 0;
+    TArchiveState st;
+    FILE *fp;
+
+    snprintf( path, sizeof( path ), "%s/v543-%llu.idx", pszArchiveDir, h->base );
+    if ( ( fp = fopen( path, "rb" ) ) == NULL ) {
+        return;
+    }
+    fseek( h->file, 0, SEEK_END );
+    long size = ftell( h->file );
+    while ( fread( entry, 1, sizeof( entry ), fp ) == sizeof( entry ) ) {
+        // wpisy rosną z czasem, dalej tylko późniejsze
+        if ( getLe64( entry + 4 ) >= h->t0 || (long)getLe32( entry ) > size ) {
+            break;
+        }
+        offset = getLe32( entry );
+        st.timestamp = getLe64( entry + 4 );
+        st.delta = (long long)getLe64( entry + 12 );
+        st.display = (int)getLe32( entry + 20 );
+        st.state = getLe32( entry + 24 );
+        st.seq = getLe32( entry + 28 );
+    }
+    fclose( fp );
+    if ( offset != 0 ) {
+        h->state = st;
+    }
+    fseek( h->file, offset != 0 ? (long)offset : ARCHIVE_HEADER_SIZE, SEEK_SET );
+}
+
+//------------------------------------------------------------------------------
+// kursor na następny segment z [t0,t1], 0 jak już nie ma
+int archiveCursorNext( THistoryCursor *h ) {
+    char path[ 256 ];
+    unsigned char header[ ARCHIVE_HEADER_SIZE ];
+    unsigned long long base;
+
+    while ( archiveFindSegment( h->base, h->t0, h->t1, &base ) > 0 ) {
+        h->base = base;
+        snprintf( path, sizeof( path ), "%s/v543-%llu.seg", pszArchiveDir, base );
+        if ( ( h->file = fopen( path, "rb" ) ) == NULL ) {
+            continue;
+        }
+        if ( fread( header, 1, sizeof( header ), h->file ) != sizeof( header ) || memcmp( header, ARCHIVE_MAGIC, 8 ) != 0 ) {
+            fclose( h->file );
+            h->file = NULL;
+            continue;
+        }
+        archiveStateInit( &h->state, base );
+        archiveCursorSeek( h );
+        return 1;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// kawałek historii do out, co najwyżej budget wysłanych rekordów
+// rekordy przed t0 nie liczą się do budżetu, indeks ogranicza je do
+// ARCHIVE_INDEX_RECORDS na segment
+// na końcu dopisuje '\n' i zamyka kursor, zwraca długość
+int archiveStreamChunk( THistoryCursor *h, char *out, int room, int budget ) {
+    int len = 0;
+    TMeterFrame f;
+
+    while ( budget > 0 && len < room - 80 ) {
+        if ( h->file == NULL && !archiveCursorNext( h ) ) {
+            archiveCursorClose( h );
+            out[ len++ ] = '\n';
+            break;
+        }
+        if ( !archiveDecode( h->file, &h->state, &f ) || f.timestamp > h->t1 ) {
+            // koniec segmentu, następny zacznie się i tak później
+            fclose( h->file );
+            h->file = NULL;
+            continue;
+        }
+        if ( f.timestamp < h->t0 ) {
+            continue;
+        }
+        budget--;
+        len += sprintf( 
+            out + len, 
+            "%s%lu,%llu,%d,%d,%d,%+E", 
+            h->sent++ ? ";" : "",
+            f.seq,
+            f.timestamp,
+            f.modeId,
+            f.rangeId,
+            f.polarity,
+            getFrameValue( &f )
+        );
+    }
+    return len;
+}
+
+
+// -------------- HTTP / SSE ---------------------------------------------------
+//
+// GET /frame   - ostatnia ramka jako JSON
+// GET /stream  - text/event-stream, każda nowa ramka jako zdarzenie z JSON
+// JSON robimy raz na ramkę i rozsyłamy wszystkim, niezależnie od liczby kart
+
+#define HTTP_MAX_CLIENTS    32
+#define HTTP_POLL_MS        50
+#define HTTP_KEEPALIVE_MS   15000   // komentarz SSE, żeby proxy nie zamykało
+
+typedef struct {
+    int     socket;         // -1 wolne
+    int     subscribed;     // 1 jak już leci strumień
+    int     length;
+    char    request[ 512 ];
+} THttpClient;
+
+int             iHttpPort = 0;
+THttpClient     httpClients[ HTTP_MAX_CLIENTS ];
+
+//------------------------------------------------------------------------------
+// ramka jako JSON, bez końca linii
+int formatFrameJson( char *out, const TMeterFrame *f ) {
+    const TRangeInfo *ri = getFrameRange( f );
+    return sprintf( 
+        out, 
+        "{\"seq\":%lu,\"timestamp\":%llu,\"modeId\":%d,\"mode\":\"%s\","
+        "\"rangeId\":%d,\"range\":\"%s\",\"rangeValue\":%E,"
+        "\"polarity\":%d,\"value\":%E,\"raw\":\"%08lX\"}",
+        f->seq,
+        f->timestamp,
+        f->modeId,
+        f->modeId <= 4 ? pszModeDesc[ f->modeId ] : "error",
+        f->rangeId,
+        ri != NULL ? ri->label : "error",
+        ri != NULL ? ri->value : 0,
+        f->polarity,
+        getFrameValue( f ),
+        f->raw
+    );
+}
+
+void httpClose( THttpClient *c ) {
+    close( c->socket );
+    c->socket = -1;
+}
+
+//------------------------------------------------------------------------------
+// nie czekamy na nikogo, kto nie nadąża ten odpada
+int httpSend( THttpClient *c, const char *data, int len ) {
+    if ( send( c->socket, data, len, MSG_NOSIGNAL | MSG_DONTWAIT ) != len ) {
+        httpClose( c );
+        return 0;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// odpowiedź na kompletne żądanie, json to ostatnia ramka
+void httpHandleRequest( THttpClient *c, const char *json ) {
+    char response[ 768 ];
+    char path[ 64 ] = "";
+    int len;
+
+    sscanf( c->request, "GET %63[^ ?]", path );
+    if ( strcmp( path, "/stream" ) == 0 ) {
+        len = sprintf( 
+            response,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: keep-alive\r\n"
+            "Access-Control-Allow-Origin: *\r\n\r\n"
+        );
+        if ( httpSend( c, response, len ) ) {
+            c->subscribed = 1;
+        }
+        return;
+    }
+    if ( strcmp( path, "/frame" ) == 0 ) {
+        len = sprintf( 
+            response,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: %d\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Connection: close\r\n\r\n%s",
+            (int)strlen( json ),
+            json
+        );
+    }
+    else {
+        len = sprintf( 
+            response,
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n"
+        );
+    }
+    if ( httpSend( c, response, len ) ) {
+        httpClose( c );
+    }
+}
+
+//------------------------------------------------------------------------------
+// wątek HTTP, jedna pętla dla wszystkich: nowe połączenia, żądania, rozsyłka
+PI_THREAD( httpThread ) {
+    struct sockaddr_in address;
+    int listenSocket;
+    char json[ 512 ] = "{}";
+    char event[ 600 ];
+    int eventLen;
+    unsigned long seq = 0;
+    unsigned int keepalive = millis();
+    TMeterFrame f;
+
+    for ( int i = 0; i < HTTP_MAX_CLIENTS; i++ ) {
+        httpClients[ i ].socket = -1;
+    }
+    if ( ( listenSocket = socket( AF_INET, SOCK_STREAM, 0 ) ) < 0 ) {
+        printf ( "60 error when opening http socket: %s\n", strerror (errno) ) ;
+        return NULL;
+    }
+    bzero( (char *)&address, sizeof(address) );
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons( iHttpPort );
+    if ( bind( listenSocket, (struct sockaddr*)&address, sizeof(address) ) < 0 ) {
+        printf ( "61 error when binding http socket: %s\n", strerror(errno) );
+        return NULL;
+    }
+    listen( listenSocket, 5 );
+    printf ( "62 http listening on port %d\n", iHttpPort );
+
+    for ( ;; ) {
+        fd_set readSet;
+        struct timeval tv = { 0, HTTP_POLL_MS * 1000 };
+        int maxFd = listenSocket;
+
+        FD_ZERO( &readSet );
+        FD_SET( listenSocket, &readSet );
+        for ( int i = 0; i < HTTP_MAX_CLIENTS; i++ ) {
+            if ( httpClients[ i ].socket >= 0 ) {
+                FD_SET( httpClients[ i ].socket, &readSet );
+                if ( httpClients[ i ].socket > maxFd ) {
+                    maxFd = httpClients[ i ].socket;
+                }
+            }
+        }
+        if ( select( maxFd + 1, &readSet, NULL, NULL, &tv ) < 0 ) {
+            continue;
+        }
+
+        // nowe ramki - JSON raz, potem do wszystkich subskrybentów
+        getMeterFrame( &f );
+        if ( seq == 0 || f.seq - seq > FRAME_RING_SIZE ) {
+            seq = f.seq > 0 ? f.seq - 1 : 0;
+        }
+        while ( seq < f.seq ) {
+            TMeterFrame g;
+            if ( !getMeterFrameAt( ++seq, &g ) ) {
+                continue;
+            }
+            formatFrameJson( json, &g );
+            eventLen = sprintf( event, "id: %lu\ndata: %s\n\n", g.seq, json );
+            for ( int i = 0; i < HTTP_MAX_CLIENTS; i++ ) {
+                if ( httpClients[ i ].socket >= 0 && httpClients[ i ].subscribed ) {
+                    httpSend( &httpClients[ i ], event, eventLen );
+                }
+            }
+            keepalive = millis();
+        }
+        if ( millis() - keepalive >= HTTP_KEEPALIVE_MS ) {
+            for ( int i = 0; i < HTTP_MAX_CLIENTS; i++ ) {
+                if ( httpClients[ i ].socket >= 0 && httpClients[ i ].subscribed ) {
+                    httpSend( &httpClients[ i ], ": ping\n\n", 8 );
+                }
+            }
+            keepalive = millis();
+        }
+
+        // żądania i rozłączenia
+        for ( int i = 0; i < HTTP_MAX_CLIENTS; i++ ) {
+            THttpClient *c = &httpClients[ i ];
+            if ( c->socket < 0 || !FD_ISSET( c->socket, &readSet ) ) {
+                continue;
+            }
+            if ( c->subscribed ) {
+                // subskrybent nic nie mówi, więc to pewnie koniec
+                char dummy[ 64 ];
+                if ( recv( c->socket, dummy, sizeof( dummy ), MSG_DONTWAIT ) <= 0 ) {
+                    httpClose( c );
+                }
+                continue;
+            }
+            int n = recv( c->socket, c->request + c->length, sizeof( c->request ) - 1 - c->length, MSG_DONTWAIT );
+            if ( n <= 0 ) {
+                httpClose( c );
+                continue;
+            }
+            c->length += n;
+            c->request[ c->length ] = '\0';
+            if ( strstr( c->request, "\r\n\r\n" ) != NULL || strstr( c->request, "\n\n" ) != NULL ) {
+                httpHandleRequest( c, json );
+            }
+            else if ( c->length >= (int)sizeof( c->request ) - 1 ) {
+                httpClose( c );
+            }
+        }
+
+        // nowe połączenie
+        if ( FD_ISSET( listenSocket, &readSet ) ) {
+            int s = accept( listenSocket, NULL, NULL );
+            int i = 0;
+            while ( i < HTTP_MAX_CLIENTS && httpClients[ i ].socket >= 0 ) {
+                i++;
+            }
+            if ( s >= 0 && i == HTTP_MAX_CLIENTS ) {
+                close( s );
+            }
+            else if ( s >= 0 ) {
+                httpClients[ i ].socket = s;
+                httpClients[ i ].subscribed = 0;
+                httpClients[ i ].length = 0;
+            }
+        }
+    }
+    return NULL;
+}
 
 //------------------------------------------------------------------------------
 // zawsze wszystko jest ok
@@ -163,30 +949,36 @@ void handleIdn(char *out) {
 //------------------------------------------------------------------------------
 // tryb pracy R,AC,DC
 void handleSenseFunction(char *out) {    
-    sprintf( out, "%d|%s\n", uchModeId, pszModeDesc[ uchModeId ] );
+    TMeterFrame f;
+    getMeterFrame( &f );
+    sprintf( out, "%d|%s\n", f.modeId, pszModeDesc[ f.modeId ] );
 }
 
 //------------------------------------------------------------------------------
 // zakres dla rezystancji
 void handleSenseResistanceRange (char *out) {
+    TMeterFrame f;
+    getMeterFrame( &f );
     sprintf( 
         out, 
         "%E|%d|%s\n", 
-        resRangeInfo[ uchRangeId ].value,
-        uchRangeId, 
-        resRangeInfo[ uchRangeId ].label
+        resRangeInfo[ f.rangeId ].value,
+        f.rangeId, 
+        resRangeInfo[ f.rangeId ].label
     );                
 }
 
 //------------------------------------------------------------------------------
 // zakres dla napiecia, AC czy DC już wszystko jedno :(
 void handleSenseVoltageRange (char *out) {
+    TMeterFrame f;
+    getMeterFrame( &f );
     sprintf( 
         out, 
         "%E|%d|%s\n", 
-        volRangeInfo[ uchRangeId ].value,
-        uchRangeId, 
-        volRangeInfo[ uchRangeId ].label
+        volRangeInfo[ f.rangeId ].value,
+        f.rangeId, 
+        volRangeInfo[ f.rangeId ].label
     );                
 }
 
@@ -194,15 +986,17 @@ void handleSenseVoltageRange (char *out) {
 //------------------------------------------------------------------------------
 // pomiar napiecia
 void handleMeasureVoltage (char *out) { 
-    if ( uchModeId != 4 /*DC*/ && uchModeId != 2 /*AC*/) {
+    TMeterFrame f;
+    getMeterFrame( &f );
+    if ( f.modeId != 4 /*DC*/ && f.modeId != 2 /*AC*/) {
         strcpy ( out, "1, wrong mode error\n" );            
         return;
     }
     char sign = ' ';
-    if ( uchModeId == 4 /*DC*/){
-        sign = uchPolarity == 1 ? '+' : '-';
+    if ( f.modeId == 4 /*DC*/){
+        sign = f.polarity == 1 ? '+' : '-';
     }    
-    float v = ((float)getNumericDisplay()) / volRangeInfo[ uchRangeId ].scale;
+    float v = ((float)getNumericDisplay( f.raw )) / volRangeInfo[ f.rangeId ].scale;
     sprintf( 
         out, 
         "%c%E\n", 
@@ -214,11 +1008,13 @@ void handleMeasureVoltage (char *out) {
 //------------------------------------------------------------------------------
 // pomiar rezystancji
 void handleMeasureResistance (char *out) { 
-    if ( uchModeId != 1 /*R*/) {
+    TMeterFrame f;
+    getMeterFrame( &f );
+    if ( f.modeId != 1 /*R*/) {
         strcpy ( out, "1, wrong mode error\n" );            
         return;
     }
-    float r = ((float)getNumericDisplay()) / resRangeInfo[ uchRangeId ].scale;
+    float r = ((float)getNumericDisplay( f.raw )) / resRangeInfo[ f.rangeId ].scale;
     sprintf( 
         out, 
         "%E\n", 
@@ -226,32 +1022,175 @@ void handleMeasureResistance (char *out) {
     );            
 }
 
+//------------------------------------------------------------------------------
+// wszystko naraz z jednej ramki, CSV:
+// tryb,opis,zakres,etykieta,wartość zakresu,polaryzacja,odczyt,raw,seq,czas
+void handleMeasureAll (char *out) {
+    TMeterFrame f;
+    getMeterFrame( &f );
+    const TRangeInfo *ri = getFrameRange( &f );
+    sprintf( 
+        out, 
+        "%d,%s,%d,%s,%E,%d,%+E,%08lX,%lu,%llu\n", 
+        f.modeId,
+        f.modeId <= 4 ? pszModeDesc[ f.modeId ] : "error",
+        f.rangeId,
+        ri != NULL ? ri->label : "error",
+        ri != NULL ? ri->value : 0,
+        f.polarity,
+        getFrameValue( &f ),
+        f.raw,
+        f.seq,
+        f.timestamp
+    );            
+}
+
+//------------------------------------------------------------------------------
+// to samo binarnie, blok IEEE 488.2 "#228" + 28 bajtów little endian:
+//  0: seq (u32), 4: czas ms (u64), 12: raw (u32),
+// 16: tryb (u8), 17: zakres (u8), 18: polaryzacja (u8), 19: zero,
+// 20: wartość zakresu (float), 24: odczyt ze znakiem (float)
+void handleMeasureAllBinary (char *out) {
+    TMeterFrame f;
+    getMeterFrame( &f );
+    const TRangeInfo *ri = getFrameRange( &f );
+    unsigned char *p = (unsigned char*)out + 4;
+    memcpy( out, "#228", 4 );
+    putLe32( p + 0, f.seq );
+    putLe64( p + 4, f.timestamp );
+    putLe32( p + 12, f.raw );
+    p[ 16 ] = f.modeId;
+    p[ 17 ] = f.rangeId;
+    p[ 18 ] = f.polarity;
+    p[ 19 ] = 0;
+    putLeFloat( p + 20, ri != NULL ? ri->value : 0 );
+    putLeFloat( p + 24, getFrameValue( &f ) );
+    p[ 28 ] = '\n';
+    iResponseLength = 4 + 28 + 1;
+}
+
+//------------------------------------------------------------------------------
+// historia z archiwum, :trac:hist? <t0>,<t1> - czasy w ms jak w :measure:all?
+// rekordy seq,czas,tryb,zakres,polaryzacja,odczyt rozdzielone ';'
+// tu tylko start, rekordy dokłada sesja kawałkami w kolejnych obiegach
+void handleTraceHistory(char *out) {
+    unsigned long long t0, t1, base;
+    THistoryCursor *h = &scpiCurrent->history;
+    if ( pszArchiveDir == NULL ) {
+        strcpy ( out, "3, archive disabled error\n" );
+        return;
+    }
+    if ( sscanf( pszScpiArgs, "%llu,%llu", &t0, &t1 ) != 2 || t0 > t1 ) {
+        strcpy ( out, "2, parameter error\n" );
+        return;
+    }
+    if ( archiveFindSegment( 0, t0, t1, &base ) < 0 ) {
+        strcpy ( out, "5, archive read error\n" );
+        return;
+    }
+    // bieżący segment też ma być widoczny
+    piLock( ARCHIVE_LOCK );
+    if ( archiveFile != NULL ) {
+        fflush( archiveFile );
+    }
+    if ( archiveIndex != NULL ) {
+        fflush( archiveIndex );
+    }
+    piUnlock( ARCHIVE_LOCK );
+
+    h->active = 1;
+    h->file = NULL;
+    h->base = 0;
+    h->t0 = t0;
+    h->t1 = t1;
+    h->sent = 0;
+    iResponseLength = 0;
+}
+
 
 //------------------------------------------------------------------------
 // odsyła znak i pięć cyferek wyświetlacza
 void handleDisplay(char *out) {
+    TMeterFrame f;
+    getMeterFrame( &f );
     char sign = ' ';
-    if ( uchModeId == 4 /*DC*/){
-        sign = uchPolarity == 1 ? '+' : '-';
+    if ( f.modeId == 4 /*DC*/){
+        sign = f.polarity == 1 ? '+' : '-';
     }
-    else if ( uchModeId == 2 /*AC*/){
+    else if ( f.modeId == 2 /*AC*/){
         sign = '~';
     }
-    sprintf( out, "%c%05X\n", sign, ulRawMeterData &0x1FFFF );    
+    sprintf( out, "%c%05lX\n", sign, f.raw &0x1FFFF );    
 } 
 
+//------------------------------------------------------------------------
+// kto ile zjada, klienci rozdzieleni ';':
+// slot,ip:port,wykonane,przytrzymane/odrzucone przez limit,sekundy sesji
+void handleSystemClients(char *out) {
+    int len = 0;
+    for ( int i = 0; i < SCPI_MAX_CLIENTS; i++ ) {
+        TScpiClient *c = &scpiClients[ i ];
+        if ( c->socket < 0 ) {
+            continue;
+        }
+        len += sprintf( 
+            out + len, 
+            "%s%d,%s:%d,%lu,%lu,%u", 
+            len ? ";" : "",
+            i,
+            inet_ntoa( c->address.sin_addr ),
+            ntohs( c->address.sin_port ),
+            c->commands,
+            c->limited,
+            ( millis() - c->since ) / 1000
+        );
+    }
+    strcpy( out + len, "\n" );
+}
+
+//------------------------------------------------------------------------
+// liczniki walidacji: opublikowane,złe BCD,zły tryb/zakres,nieprawdopodobne,
+// ponowne odczyty,uratowane,za krótkie okno READY
+void handleSystemFrames(char *out) {
+    TFrameStats st;
+    piLock( FRAME_LOCK );
+    st = frameStats;
+    piUnlock( FRAME_LOCK );
+    sprintf( 
+        out, 
+        "%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", 
+        st.published,
+        st.badBcd,
+        st.badRange,
+        st.implausible,
+        st.reclocked,
+        st.recovered,
+        st.windowClosed
+    );
+}
+
 //------------------------------------------------------------------------
 // odsyła surowe 32 bity hex
 void handleRaw(char *out) {
-    sprintf( out, "%08X\n", ulRawMeterData );    
+    TMeterFrame f;
+    getMeterFrame( &f );
+    sprintf( out, "%08lX\n", f.raw );    
 }
 
 
 //------------------------------------------------------------------------
-// rozpoznanie i wykonanie polecenia SCPI
-void processScpiCommand ( char *cmd, char *out ) {
+// rozpoznanie i wykonanie polecenia SCPI, zwraca długość odpowiedzi
+int processScpiCommand ( char *cmd, char *out ) {
     // domyslnie blad
     strcpy ( out, "error\n" );    
+    iResponseLength = -1;
+    // parametry po pierwszej spacji
+    char *args = strchr( cmd, ' ' );
+    pszScpiArgs = "";
+    if ( args != NULL ) {
+        *args++ = '\0';
+        pszScpiArgs = trim( args );
+    }
     for( int i = 0; scpiCommands[i].cmd != NULL; ++i ) {
         if ( strcmp ( cmd, scpiCommands[i].cmd ) == 0 ) {
             // trafiony!
@@ -261,6 +1200,7 @@ void processScpiCommand ( char *cmd, char *out ) {
     }
     digitalWrite ( LED_SCPI, uchLedScpi ) ;        
     uchLedScpi ^= 1;    
+    return iResponseLength < 0 ? strlen( out ) : iResponseLength;
 }
 
 //------------------------------------------------------------------------
@@ -281,19 +1221,264 @@ unsigned long readV543rawData( void ) {
   return rawFrame & 0x03FFFFFFL;
 }
 
+//------------------------------------------------------------------------
+// czy ramka ma sens - sama w sobie i w porównaniu z poprzednią
+int checkFrame( unsigned long raw, const TMeterFrame *prev ) {
+    TMeterFrame f;
+    const TRangeInfo *ri;
+    // cztery młodsze cyferki BCD, najstarsza to jeden bit
+    for ( int i = 0; i < 4; i++ ) {
+        if ( ( ( raw >> ( 4 * i ) ) & 0x0F ) > 9 ) {
+            return FRAME_BAD_BCD;
+        }
+    }
+    f.raw = raw;
+    f.rangeId = (raw >> 17) & 0x07;
+    f.modeId = (raw >> 22) & 0x07;
+    ri = getFrameRange( &f );
+    if ( ri == NULL || strcmp( ri->label, "error" ) == 0 ) {
+        return FRAME_BAD_RANGE;
+    }
+    if ( prev->seq == 0 ) {
+        return FRAME_OK;
+    }
+    // zmiana trybu/zakresu albo duży skok - trzeba potwierdzić
+    if ( f.modeId != prev->modeId || f.rangeId != prev->rangeId ||
+         abs( getNumericDisplay( raw ) - getNumericDisplay( prev->raw ) ) > FRAME_JUMP_LIMIT ) {
+        return FRAME_IMPLAUSIBLE;
+    }
+    return FRAME_OK;
+}
+
 //------------------------------------------------------------------------
 // obsługa przerwania od GPIO z pinu LINE_READY Meratronika
 void onMeterReadyInterrupt( void ) {        
-    // fizyczny odczyt
-    ulRawMeterData = readV543rawData();    
-    uchRangeId = (ulRawMeterData >> 17) & 0x07;
-    uchModeId = (ulRawMeterData >> 22) & 0x07;
-    uchPolarity = (ulRawMeterData >> 20) & 0x03;
+    TMeterFrame f;
+    struct timeval tv;
+    unsigned long again;
+    int reclocked = 0;
+    // fizyczny odczyt, meterFrame zmienia tylko przerwanie, więc czytamy bez blokady
+    f.raw = readV543rawData();    
+    int verdict = checkFrame( f.raw, &meterFrame );
+    int first = verdict;
+    // podejrzana - odczyt jeszcze raz, póki trwa to samo okno READY
+    // (po zgaśnięciu READY miernik już zmienia rejestr)
+    while ( verdict != FRAME_OK && reclocked < iFrameReclock && digitalRead( LINE_READY ) ) {
+        again = readV543rawData();
+        reclocked++;
+        if ( verdict == FRAME_IMPLAUSIBLE && again == f.raw ) {
+            verdict = FRAME_OK;     // dwa razy to samo, więc naprawdę się zmieniło
+            break;
+        }
+        f.raw = again;
+        verdict = checkFrame( f.raw, &meterFrame );
+    }
+    int windowClosed = ( verdict != FRAME_OK && reclocked < iFrameReclock );
+    // skok nie potwierdził się w tym oknie (albo bez ponownych odczytów) -
+    // jak następne okno do niego pasuje, to miernik naprawdę pokazuje coś nowego
+    if ( verdict == FRAME_IMPLAUSIBLE ) {
+        if ( frameCandidate.seq != 0 && checkFrame( f.raw, &frameCandidate ) == FRAME_OK ) {
+            verdict = FRAME_OK;
+        }
+        else {
+            frameCandidate.raw = f.raw;
+            frameCandidate.rangeId = (f.raw >> 17) & 0x07;
+            frameCandidate.modeId = (f.raw >> 22) & 0x07;
+            frameCandidate.seq = 1;
+        }
+    }
+    if ( verdict == FRAME_OK ) {
+        frameCandidate.seq = 0;
+    }
+    gettimeofday( &tv, NULL );
+    f.rangeId = (f.raw >> 17) & 0x07;
+    f.modeId = (f.raw >> 22) & 0x07;
+    f.polarity = (f.raw >> 20) & 0x03;
+    f.timestamp = (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    // podmiana całej ramki naraz, tylko sprawdzonej
+    piLock( FRAME_LOCK );
+    frameStats.reclocked += reclocked;
+    frameStats.windowClosed += windowClosed;
+    if ( verdict == FRAME_OK ) {
+        f.seq = meterFrame.seq + 1;
+        meterFrame = f;
+        frameRing[ f.seq % FRAME_RING_SIZE ] = f;
+        frameStats.published++;
+        frameStats.recovered += ( first != FRAME_OK );
+    }
+    else if ( verdict == FRAME_BAD_BCD ) {
+        frameStats.badBcd++;
+    }
+    else if ( verdict == FRAME_BAD_RANGE ) {
+        frameStats.badRange++;
+    }
+    else {
+        frameStats.implausible++;
+    }
+    piUnlock( FRAME_LOCK );
     // mignięcie ledem
     digitalWrite ( LED_READY, uchLedReady ) ;        
     uchLedReady ^= 1;
 }
 
+// -------------- sesje SCPI ---------------------------------------------------
+
+void scpiClose( TScpiClient *c ) {
+    archiveCursorClose( &c->history );
+    close( c->socket );
+    c->socket = -1;
+    printf ( "33 end session\n" );
+}
+
+//------------------------------------------------------------------------
+// długość gotowego polecenia w buforze, 0 jak jeszcze nie ma całego
+// reszta bez '\n' idzie w całości jak bufor pełny albo klient już nic nie doda
+int scpiCommandReady( TScpiClient *c ) {
+    char *nl = (char*)memchr( c->input, '\n', c->length );
+    if ( nl != NULL ) {
+        return nl - c->input + 1;
+    }
+    if ( c->length == sizeof( c->input ) || ( c->length > 0 && c->closing ) ) {
+        return c->length;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------
+// kubełek żetonów, 1 jak można wykonać polecenie
+int scpiTakeToken( TScpiClient *c ) {
+    unsigned int now = millis();
+    if ( fScpiRate <= 0 ) {
+        return 1;
+    }
+    c->tokens += ( now - c->refill ) * fScpiRate / 1000;
+    if ( c->tokens > fScpiBurst ) {
+        c->tokens = fScpiBurst;
+    }
+    c->refill = now;
+    if ( c->tokens < 1 ) {
+        return 0;
+    }
+    c->tokens -= 1;
+    return 1;
+}
+
+//------------------------------------------------------------------------
+// za ile ms klient będzie miał co robić: 0 od razu, -1 dopiero jak coś przyjdzie
+int scpiWaitMs( TScpiClient *c ) {
+    int room = sizeof( c->output ) - c->outLength;
+    if ( c->history.active ) {
+        return room < 128 ? -1 : 0;
+    }
+    if ( c->length == 0 || room < 1024 ) {
+        return -1;  // bez poleceń albo czeka aż klient odbierze
+    }
+    if ( scpiCommandReady( c ) == 0 ) {
+        return -1;  // niepełna linia, czeka na resztę
+    }
+    // przytrzymane czeka na następny żeton
+    if ( c->held && iScpiRateDelay ) {
+        float tokens = c->tokens + ( millis() - c->refill ) * fScpiRate / 1000;
+        return tokens < 1 ? 1 + (int)( ( 1 - tokens ) * 1000 / fScpiRate ) : 0;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------
+// ile się da z kolejki wyjściowej, bez czekania na klienta
+void scpiFlush( TScpiClient *c ) {
+    if ( c->socket < 0 || c->outLength == 0 ) {
+        return;
+    }
+    int n = send( c->socket, c->output, c->outLength, MSG_NOSIGNAL | MSG_DONTWAIT );
+    if ( n < 0 ) {
+        if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+            printf ( "04 error when sending response: %s\n", strerror (errno) );
+            scpiClose( c );
+        }
+        return;
+    }
+    c->outLength -= n;
+    memmove( c->output, c->output + n, c->outLength );
+}
+
+//------------------------------------------------------------------------
+// co najwyżej SCPI_BUDGET poleceń klienta, reszta w następnym obiegu
+// jak klient nie odbiera i kolejka wyjściowa pełna, to też czeka
+void scpiServeClient( TScpiClient *c ) {
+    char commandBuffer[ sizeof( c->input ) + 1 ];   // cały bufor wejściowy plus '\0'
+    char responseBuffer[ 1024 ];
+    int responseLength;
+
+    for ( int budget = SCPI_BUDGET; budget > 0 && c->socket >= 0; budget-- ) {
+        int room = sizeof( c->output ) - c->outLength;
+        // historia w toku idzie przed kolejnymi poleceniami
+        if ( c->history.active ) {
+            if ( room < 128 ) {
+                return;
+            }
+            c->outLength += archiveStreamChunk( &c->history, c->output + c->outLength, room, SCPI_HISTORY_BUDGET );
+            if ( c->history.active ) {
+                return;     // reszta w następnym obiegu
+            }
+            continue;
+        }
+        if ( room < (int)sizeof( responseBuffer ) ) {
+            return;
+        }
+        int n = scpiCommandReady( c );
+        if ( n == 0 ) {
+            return;
+        }
+        memcpy( commandBuffer, c->input, n );
+        commandBuffer[ n ] = '\0';
+        makeLower( trim( commandBuffer ) );
+        // pusta linia nic nie kosztuje
+        if ( strlen( commandBuffer ) == 0 ) {
+            c->length -= n;
+            memmove( c->input, c->input + n, c->length );
+            continue;
+        }
+        int allowed = scpiTakeToken( c );
+        if ( !allowed ) {
+            // przytrzymane liczymy raz, nie co obieg
+            if ( !c->held ) {
+                c->limited++;
+            }
+            c->held = 1;
+            if ( iScpiRateDelay ) {
+                return;     // poczeka w buforze na żeton
+            }
+        }
+        c->held = 0;
+        c->length -= n;
+        memmove( c->input, c->input + n, c->length );
+
+        if ( allowed ) {
+            printf ( "04 process session [%04lu]\n", c->commands++ );
+            scpiCurrent = c;
+            responseLength = processScpiCommand ( commandBuffer, responseBuffer );
+        }
+        else {
+            strcpy ( responseBuffer, "4, rate limit error\n" );
+            iResponseLength = -1;
+            responseLength = strlen( responseBuffer );
+        }
+
+        memcpy( c->output + c->outLength, responseBuffer, responseLength );
+        c->outLength += responseLength;
+        if ( c->history.active ) {
+            printf( "12 SCPI [%s]->[stream]\n", commandBuffer );    
+        }       
+        else if ( iResponseLength >= 0 ) {
+            printf( "12 SCPI [%s]->[%d bytes]\n", commandBuffer, responseLength );    
+        }       
+        else {
+            printf( "12 SCPI [%s]->[%s]\n", commandBuffer, trim( responseBuffer)  );    
+        }       
+    }
+}
+
 // main foo.
 int main( int argc, char *argv[] ) {
 
@@ -301,11 +1486,35 @@ int main( int argc, char *argv[] ) {
     int serverSocket, clientSocket;
     int clientAddressLen;
     int n;
-    int data;
-    char commandBuffer[ 64 ];
-    char responseBuffer[ 64 ];  
     int sessionCntr = 0;
-    int commandCntr = 0;    
+    int roundRobin = 0;
+    int opt;
+
+    while ( ( opt = getopt( argc, argv, "a:w:r:b:dc:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'a':
+                pszArchiveDir = optarg;
+                break;
+            case 'w':
+                iHttpPort = atoi( optarg );
+                break;
+            case 'r':
+                fScpiRate = atof( optarg );
+                break;
+            case 'b':
+                fScpiBurst = atof( optarg );
+                break;
+            case 'd':
+                iScpiRateDelay = 1;
+                break;
+            case 'c':
+                iFrameReclock = atoi( optarg );
+                break;
+            default:
+                printf ( "usage: %s [-a archive_dir] [-w http_port] [-r rate [-b burst] [-d]] [-c reclock]\n", argv[ 0 ] );
+                exit (1);
+        }
+    }
      
     wiringPiSetup () ;     
     pinMode ( LINE_READY, INPUT );
@@ -321,6 +1530,16 @@ int main( int argc, char *argv[] ) {
         printf ( "Unable to setup ISR: %s\n", strerror (errno) );
         exit(1) ;
     }    
+
+    if ( pszArchiveDir != NULL && piThreadCreate( archiveThread ) != 0 ) {
+        printf ( "Unable to start archive thread: %s\n", strerror (errno) );
+        exit(1) ;
+    }
+
+    if ( iHttpPort > 0 && piThreadCreate( httpThread ) != 0 ) {
+        printf ( "Unable to start http thread: %s\n", strerror (errno) );
+        exit(1) ;
+    }
          
      serverSocket = socket( AF_INET, SOCK_STREAM, 0 );
      if ( serverSocket < 0 ) {
@@ -340,59 +1559,142 @@ int main( int argc, char *argv[] ) {
      
      listen( serverSocket, 5);     
      clientAddressLen = sizeof(clientAddress);
+
+     // rozłączony klient nie może zabić serwera
+     signal( SIGPIPE, SIG_IGN );
+     for ( int i = 0; i < SCPI_MAX_CLIENTS; i++ ) {
+         scpiClients[ i ].socket = -1;
+     }
   
-     int exitRequest;
+     // czekaj na polecenia, wszyscy klienci po kolei
      
-     // czekaj na polecenia     
+     printf( "10 waiting for connection [%04d]\n", sessionCntr );
      
      while ( 1 ) {
-       
-        printf( "10 waiting for connection [%04d]\n", sessionCntr++ );
-	
-        if ( ( clientSocket = accept( serverSocket, (struct sockaddr *)&clientAddress, (socklen_t*)&clientAddressLen) ) < 0 ) {	        
-            printf ( "02 error on accept incoming connection: %s\n", strerror (errno) );                     
-	        exit (1);
-	    }
-        
-        printf ( "03 begin session\n" );                     
-        
-        printf( "03 remote peer ip %s , port %d \n" , 
-                inet_ntoa( clientAddress.sin_addr ) , 
-                ntohs( clientAddress.sin_port ) 
-        );           
-        
-	    while( 1 ){	
-            
-    	    bzero( commandBuffer, sizeof( commandBuffer ) );
-	        bzero( responseBuffer, sizeof( responseBuffer ) );	  	
-	
-        	if ( ( n = read( clientSocket, commandBuffer, sizeof( commandBuffer ) - 1 ) ) == 0 ){    
-                close( clientSocket );            
-                printf ( "33 end session\n" );                                     
-                break;
-	        }
-	        else {
-                printf ( "04 process session [%04d]\n", commandCntr++ );
-                if ( strlen(commandBuffer) == 0 ) {
-                    close( clientSocket );                                
-                    printf ( "55 end session\n" );                                                                 
-                    break;
-                }
+        fd_set readSet, writeSet;
+        struct timeval tv;
+        int maxFd = serverSocket;
+        int wait = -1;
 
-                makeLower( commandBuffer );
-	            
-	            processScpiCommand ( trim( commandBuffer ), responseBuffer );
-    
-	            if ( (n = write( clientSocket, responseBuffer, strlen( responseBuffer ) ) ) < 0 ) {	        
-                    printf ( "04 error when sending response: %s\n", strerror (errno) );
-	                exit (1);	      	      	   
-	            } 
-	            else {
-                    printf( "12 SCPI [%s]->[%s]\n", commandBuffer, trim( responseBuffer)  );    
-                }       
-            }        
-        } // of session while     
-        commandCntr = 0;
+        FD_ZERO( &readSet );
+        FD_ZERO( &writeSet );
+        FD_SET( serverSocket, &readSet );
+        for ( int i = 0; i < SCPI_MAX_CLIENTS; i++ ) {
+            TScpiClient *c = &scpiClients[ i ];
+            if ( c->socket < 0 ) {
+                continue;
+            }
+            if ( c->socket > maxFd ) {
+                maxFd = c->socket;
+            }
+            // odpowiedzi czekają na klienta - budzimy się jak odbierze
+            if ( c->outLength > 0 ) {
+                FD_SET( c->socket, &writeSet );
+            }
+            // najbliższy klient, który będzie miał co robić
+            int w = scpiWaitMs( c );
+            if ( w >= 0 && ( wait < 0 || w < wait ) ) {
+                wait = w;
+            }
+            if ( c->length == sizeof( c->input ) || c->closing ) {
+                continue;   // pełny albo klient już skończył, najpierw niech się wykona co jest
+            }
+            FD_SET( c->socket, &readSet );
+        }
+        // gotowe polecenia od razu, niepełne linie do końca czekania, inaczej do skutku
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = ( wait % 1000 ) * 1000;
+        if ( select( maxFd + 1, &readSet, &writeSet, NULL, wait >= 0 ? &tv : NULL ) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            printf ( "02 error on select: %s\n", strerror (errno) );
+            exit (1);
+        }
+
+        if ( FD_ISSET( serverSocket, &readSet ) ) {
+            if ( ( clientSocket = accept( serverSocket, (struct sockaddr *)&clientAddress, (socklen_t*)&clientAddressLen) ) < 0 ) {	        
+                printf ( "02 error on accept incoming connection: %s\n", strerror (errno) );                     
+                exit (1);
+            }
+            int i = 0;
+            while ( i < SCPI_MAX_CLIENTS && scpiClients[ i ].socket >= 0 ) {
+                i++;
+            }
+            if ( i == SCPI_MAX_CLIENTS ) {
+                printf ( "03 too many sessions, rejected\n" );
+                close( clientSocket );
+            }
+            else {
+                TScpiClient *c = &scpiClients[ i ];
+                fcntl( clientSocket, F_SETFL, fcntl( clientSocket, F_GETFL ) | O_NONBLOCK );
+                c->socket = clientSocket;
+                c->address = clientAddress;
+                c->length = 0;
+                c->tokens = fScpiBurst;
+                c->refill = c->since = millis();
+                c->commands = 0;
+                c->limited = 0;
+                c->held = 0;
+                c->closing = 0;
+                c->outLength = 0;
+                c->history.active = 0;
+                c->history.file = NULL;
+                printf ( "03 begin session [%04d]\n", sessionCntr++ );
+                printf( "03 remote peer ip %s , port %d \n" , 
+                        inet_ntoa( clientAddress.sin_addr ) , 
+                        ntohs( clientAddress.sin_port ) 
+                );           
+            }
+        }
+
+        // co przyszło do buforów
+        for ( int i = 0; i < SCPI_MAX_CLIENTS; i++ ) {
+            TScpiClient *c = &scpiClients[ i ];
+            if ( c->socket < 0 || !FD_ISSET( c->socket, &readSet ) ) {
+                continue;
+            }
+            int space = sizeof( c->input ) - c->length;
+            int fresh = ( c->length == 0 || c->input[ c->length - 1 ] == '\n' );
+            if ( ( n = read( c->socket, c->input + c->length, space ) ) < 0 && 
+                 ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+                continue;
+            }
+            if ( n < 0 ) {
+                scpiClose( c );
+                continue;
+            }
+            // koniec od klienta - to co w buforze jeszcze się wykona i wyśle
+            if ( n == 0 ) {
+                c->closing = 1;
+                continue;
+            }
+            // jak dawniej: kawałek bez '\n' to całe polecenie - o ile zaczyna linię
+            // i nie urwał go brak miejsca w buforze, wtedy to tylko środek linii
+            if ( fresh && n < space && memchr( c->input + c->length, '\n', n ) == NULL ) {
+                c->input[ c->length + n++ ] = '\n';
+            }
+            c->length += n;
+        }
+
+        // po kolei, każdy dostaje swój budżet, zaczynamy co obieg od kogo innego
+        for ( int k = 0; k < SCPI_MAX_CLIENTS; k++ ) {
+            TScpiClient *c = &scpiClients[ ( roundRobin + k ) % SCPI_MAX_CLIENTS ];
+            if ( c->socket >= 0 ) {
+                scpiServeClient( c );
+            }
+        }
+        roundRobin = ( roundRobin + 1 ) % SCPI_MAX_CLIENTS;
+
+        // odpowiedzi w sieć, ile kto akurat przyjmie
+        // zamykamy dopiero jak wszystko wyszło
+        for ( int i = 0; i < SCPI_MAX_CLIENTS; i++ ) {
+            TScpiClient *c = &scpiClients[ i ];
+            scpiFlush( c );
+            if ( c->socket >= 0 && c->closing && c->length == 0 && !c->history.active && c->outLength == 0 ) {
+                scpiClose( c );
+            }
+        }
      } // of server while
      return 0; 
 }